@@ -0,0 +1,70 @@
+#ifndef SELECTION_H
+#define SELECTION_H
+
+#include <vector>
+#include <algorithm>
+
+// ************************************
+// Per-triangle selection mask, packed as one bit per triangle.
+// Triangle t is bit (t & 7) of byte (t >> 3), which is the layout read by shader.frag
+// through a GL_R8UI texture buffer indexed with gl_PrimitiveID.
+// No OpenGL call here: the owner uploads bytes [lo, hi) when dirty() and then calls clean().
+class SelectionMask{
+public:
+  std::vector<unsigned char> bits;
+  int lo, hi;  // Range of bytes modified since the last upload
+
+  SelectionMask() : lo(0), hi(0){}
+
+  void resize(int nTriangles){
+    bits.assign((nTriangles + 7) / 8, 0);
+    lo = 0;
+    hi = bits.size();
+  }
+  int size() const {return bits.size();}
+
+  bool get(int t) const {
+    return (bits[t >> 3] >> (t & 7)) & 1;
+  }
+  void set(int t, bool value){
+    unsigned char mask  = 1 << (t & 7);
+    unsigned char old   = bits[t >> 3];
+    unsigned char byte  = value ? (old | mask) : (old & ~mask);
+    // Unchanged bytes are not uploaded again
+    if(byte != old){
+      bits[t >> 3] = byte;
+      touch(t >> 3);
+    }
+  }
+  void clear(){
+    for(int i = 0 ; i < bits.size() ; i++)
+      if(bits[i]){
+        bits[i] = 0;
+        touch(i);
+      }
+  }
+  int count() const {
+    int n = 0;
+    for(int i = 0 ; i < bits.size() ; i++)
+      for(unsigned char b = bits[i] ; b ; b &= b - 1)
+        n++;
+    return n;
+  }
+
+  bool dirty() const {return lo < hi;}
+  void clean(){lo = hi = 0;}
+
+private:
+  void touch(int byte){
+    if(!dirty()){
+      lo = byte;
+      hi = byte + 1;
+    }
+    else{
+      lo = std::min(lo, byte);
+      hi = std::max(hi, byte + 1);
+    }
+  }
+};
+
+#endif
@@ -6,6 +6,18 @@
 #include <set>
 #include <iostream>
 #include <fstream>
+#include <atomic>
+#include <thread>
+#include <list>
+#include <unordered_map>
+#include <cstring>
+#include <cfloat>
+
+// Memory mapped files, for the out-of-core storage
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 // OpenGL libraries
 #define GLEW_STATIC
@@ -26,6 +38,9 @@
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
+// Per-triangle selection
+#include "selection.h"
+
 //libmesh from the "Commons" library
 extern "C" {
 #include <libmesh5.h>
@@ -46,9 +61,13 @@ void initGLEW();
 // ************************************
 // OpenGL custom wrappers for buffer operations
 template<typename T> GLuint createBuffer(GLenum target, std::vector<T> *data);
+template<typename T> GLuint createBuffer(GLenum target, T* data, int n);
 GLuint createVAO();
+GLuint createTextureBuffer(GLuint buffer, GLenum format);
+void updateMask(GLuint sBuffer, SelectionMask* mask);
 void bindBuffer(GLenum target, GLuint buffer, int ID, int attrib=0, char* name=nullptr);
 template<typename T> void updateBuffer(GLuint pBuffer, std::vector<T> *data);
+template<typename T> void updateBuffer(GLuint pBuffer, T* data, int n);
 void send(int ID, glm::mat4 &m, char* name);
 void send(int ID, glm::vec3 v, char* name);
 void send(int ID, float f, char* name);
@@ -94,23 +113,141 @@ public:
   }
 };
 Context* myContext;
+// Segmentation of the surface in smooth patches, separated by sharp edges
+class Segmentation{
+public:
+  std::vector<int>              edges;          // Pairs of adjacent triangles, sorted by dihedral angle
+  std::vector<float>            angles;         // Dihedral angle of each pair (radians, ascending)
+  std::vector<std::atomic<int>> parent;         // Lock-free union-find forest on the triangles
+  std::vector<int>              patch;          // Patch number of each triangle
+  std::vector<int>              patchStart;     // Offsets of each patch in patchTriangles
+  std::vector<int>              patchTriangles; // Triangles grouped by patch
+  float                         threshold;      // Edges below this angle are merged
+  int                           united;         // Number of sorted edges already merged in the forest
+  Segmentation() : threshold(glm::radians(20.0f)), united(0){}
+
+  void build(std::vector<glm::vec3>& vertices, std::vector<int>& triangles);
+  void segment(float newThreshold);
+  std::vector<int> getPatch(int ind);
+  int  find(int t);
+  void unite(int a, int b);
+};
 // Custom object class
 class Object{
 public:
-  std::vector<glm::vec3>            vertices, colors;
+  std::vector<glm::vec3>            vertices, normals;
+  SelectionMask                     selection;
   std::vector<int>                  triangles;
   std::vector<std::vector<int>>     neighbours;
   std::vector<int>                  selected;
+  Segmentation                      segmentation;
   glm::mat4                         MODEL;
-  GLuint VAO, vBuffer, cBuffer, iBuffer, nBuffer, cPickingBuffer;
-  void read(char * mesh_path);
-
-  void createNeighbours();//A créer et remplir à la lecture de l'objet
+  GLuint VAO, vBuffer, iBuffer, nBuffer, cPickingBuffer;
+  GLuint sBuffer, sTexture; // Selection mask, as a texture buffer
+  void createNeighbours(const std::atomic<bool>* cancel = NULL);//A créer et remplir à la lecture de l'objet
+  void createNormals();
   std::vector<int> getNeighbours(int ind, int level);
 
 
 };
 Object* myObject;
+// Out-of-core storage, for meshes larger than memory
+// The .pages file holds spatially coherent pages of triangles with their own vertices,
+// each page being mapped from disk only when it is drawn, within a memory budget.
+struct PageFileHeader{
+  char      magic[8];
+  int       nPages, trianglesPerPage;
+  long long alignment;        // Pages offsets are multiples of it, so that they can be mapped
+};
+struct PageInfo{
+  long long offset, size;     // Location of the page in the file, in bytes
+  int       nVertices, nTriangles;
+  glm::vec3 mi, ma;           // Bounding box of the page
+};
+struct Page{
+  void*      data;            // Mapped region of the file
+  glm::vec3* vertices;
+  int*       triangles;       // Indices in the page vertices
+  GLuint     VAO, vBuffer, iBuffer;
+  GLuint     sBuffer, sTexture; // Selection mask of the page, as a texture buffer
+  int        lastFrame;       // Pages drawn in the current frame are never evicted
+  std::list<int>::iterator lru;
+};
+class PagedMesh{
+public:
+  int                   fd;
+  std::vector<PageInfo> infos;
+  std::vector<Page*>    pages;      // NULL when the page is not resident
+  std::vector<bool>     prefetched; // Read-ahead already requested to the kernel
+  std::vector<SelectionMask> masks; // Selection of each page, kept when the page is evicted
+  std::list<int>        lru;        // Resident pages, most recently drawn first
+  size_t                budget, used;
+  int                   frame, maxLoadsPerFrame, maxPrefetch;
+  PagedMesh() : fd(-1), budget(0), used(0), frame(0), maxLoadsPerFrame(8), maxPrefetch(16){}
+
+  static void convert(char* mesh_path, std::string pages_path, int trianglesPerPage);
+  void  open(std::string path, size_t budgetMB);
+  Page* load(int p, int ID);
+  void  evict(int p);
+  bool  draw(Context* c, int ID, glm::mat4& MODEL);
+  void  prefetch(Context* c, glm::mat4& MODEL);
+  bool  intersects(Context* c, int x, int y, glm::mat4& MODEL, int& page, int& ind);
+  void  paint(int page, int ind, bool value);
+};
+PagedMesh* myPagedMesh = NULL;
+// Background loading of the object, published stage by stage to the display loop
+enum{
+  LOAD_VERTICES,   // Reading the vertices, nothing can be displayed yet
+  LOAD_TRIANGLES,  // Vertices are final, triangles are streamed as they are read
+  LOAD_STRUCTURES, // All triangles are read, building adjacency, normals and segmentation
+  LOAD_DONE        // Picking, painting and segmentation are available
+};
+class Loader{
+public:
+  Object*          object;
+  int              inm;                         // libmesh file, only used by the loading thread once started
+  int              nVertices, nTriangles;
+  std::thread      thread;
+  std::atomic<int> stage, verticesRead, trianglesRead;
+  std::atomic<bool> cancel;                     // Set by the display loop on exit, the loading stops early
+  // Display loop side
+  int              seenStage, seenVertices, trianglesUploaded;
+  Loader() : object(NULL), inm(0), nVertices(0), nTriangles(0), stage(LOAD_VERTICES), verticesRead(0), trianglesRead(0), cancel(false), seenStage(LOAD_VERTICES), seenVertices(0), trianglesUploaded(0){}
+
+  void  start(Object* o, std::string mesh_path);
+  void  run();
+  bool  pending();
+  void  upload(int ID);
+  float progress(){return float(verticesRead + trianglesRead) / float(nVertices + nTriangles);}
+};
+Loader* myLoader = NULL;
+bool loaded(int stage){
+  return myLoader && myLoader->stage >= stage;
+}
+// Render scheduler: a frame is only drawn when something has been invalidated
+enum{
+  DIRTY_CAMERA  = 1<<0, // VIEW or PROJ changed
+  DIRTY_MODEL   = 1<<1, // MODEL changed
+  DIRTY_COLORS  = 1<<2, // selection masks must be uploaded
+  DIRTY_OVERLAY = 1<<3, // text overlay changed
+  DIRTY_PAGES   = 1<<4, // visible pages are still being loaded
+  DIRTY_MESH    = 1<<5, // the loader published new data
+  DIRTY_ALL     = DIRTY_CAMERA | DIRTY_MODEL | DIRTY_COLORS | DIRTY_OVERLAY | DIRTY_PAGES | DIRTY_MESH
+};
+class Scheduler{
+public:
+  int    dirty;
+  bool   autoRotate;
+  float  rotationSpeed; // radians per second
+  double idleTimeout;   // seconds to wait for events when nothing is animated
+  double lastTime;
+  Scheduler() : dirty(DIRTY_ALL), autoRotate(false), rotationSpeed(0.06f), idleTimeout(1.0), lastTime(0){}
+  void invalidate(int flags){dirty |= flags;}
+  bool needsDraw(){return dirty != 0;}
+  // Time to sleep waiting for input before the next animation step
+  double timeout(){return autoRotate ? 1.0/60.0 : idleTimeout;}
+};
+Scheduler* myScheduler;
 
 // ************************************
 // Ray and intersection computing
@@ -176,27 +313,36 @@ static void cursor_pos_callback(GLFWwindow* window, double xpos, double ypos){
           lastY = ypos;
           int indice = -1;
 
+          // Paged meshes can only be picked on their resident pages, and are painted triangle by triangle
+          if(myPagedMesh){
+            int page = -1;
+            if(myPagedMesh->intersects(myContext, xpos, ypos, myObject->MODEL, page, indice)){
+              myPagedMesh->paint(page, indice, add);
+              myScheduler->invalidate(DIRTY_COLORS);
+            }
+            return;
+          }
+          // Brushes need the neighbours, built at the end of the loading
+          if(!loaded(LOAD_DONE))
+            return;
+
           // Does the ray intersects? If so, indice is the index of the triangle intersected.
           bool intersects = intersectsWithTriangle(myContext, myObject, xpos, ypos, indice);
 
-          // If intersection, paint everything white except the concerned triangle
+          // If intersection, select (or unselect) the triangles around the concerned one
           if(intersects){
             //New version
             std::vector<int> neigh = myObject->getNeighbours(indice, rayon);
-            glm::vec3 color = add ? glm::vec3(1, 0.5, 0) : glm::vec3(1, 1, 1);
-            for(int k; k < neigh.size(); k++){
-                myObject->colors[ myObject->triangles[neigh[k] + 0]] = color;
-                myObject->colors[ myObject->triangles[neigh[k] + 1]] = color;
-                myObject->colors[ myObject->triangles[neigh[k] + 2]] = color;
-            }
+            for(int k = 0; k < neigh.size(); k++)
+                myObject->selection.set(neigh[k]/3, add);
 
-            updateBuffer( myObject->cBuffer, &myObject->colors);
+            // Upload is deferred to the next frame, so several strokes cost one transfer
+            myScheduler->invalidate(DIRTY_COLORS);
           }
-          // Else, paint everything white
+          // Else, unselect everything
           else{
-            for(int i = 0 ; i < myObject->colors.size() ; i++)
-              myObject->colors[ i ] = glm::vec3(1);
-            updateBuffer( myObject->cBuffer, &myObject->colors);
+            myObject->selection.clear();
+            myScheduler->invalidate(DIRTY_COLORS);
           }
     }
 }
@@ -205,6 +351,11 @@ void window_size_callback(GLFWwindow* window, int width, int height){
   myContext->h = height;
   myContext->update();
   glViewport(0, 0, width, height);
+  myScheduler->invalidate(DIRTY_CAMERA);
+}
+void window_refresh_callback(GLFWwindow* window){
+  // The window was exposed or resized, its content is lost
+  myScheduler->invalidate(DIRTY_ALL);
 }
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset){
     //xoffset is used for trackpads, only yoffset is of interest for us.
@@ -212,10 +363,12 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset){
     if(yoffset > 0 && myContext->fov <90){
       myContext->zoom *= 1+0.05;
       myContext->update();
+      myScheduler->invalidate(DIRTY_CAMERA);
     }
     if(yoffset < 0 && myContext->fov >30){
       myContext->zoom *= 1-0.05;
       myContext->update();
+      myScheduler->invalidate(DIRTY_CAMERA);
     }
 }
 void error_callback(int error, const char* description){
@@ -229,17 +382,50 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
         break;
       case GLFW_KEY_TAB:
         add = !add;
+        myScheduler->invalidate(DIRTY_OVERLAY);
         break;
       case GLFW_KEY_UP:
         rayon+=1;
+        myScheduler->invalidate(DIRTY_OVERLAY);
         break;
       case GLFW_KEY_DOWN:
         rayon-=1;
+        myScheduler->invalidate(DIRTY_OVERLAY);
+        break;
+      case GLFW_KEY_RIGHT:
+        if(!loaded(LOAD_DONE))
+          break;
+        myObject->segmentation.segment(myObject->segmentation.threshold + glm::radians(2.0f));
+        myScheduler->invalidate(DIRTY_OVERLAY);
+        break;
+      case GLFW_KEY_LEFT:
+        if(!loaded(LOAD_DONE))
+          break;
+        myObject->segmentation.segment(std::max(0.0f, myObject->segmentation.threshold - glm::radians(2.0f)));
+        myScheduler->invalidate(DIRTY_OVERLAY);
+        break;
+      case GLFW_KEY_R:
+        myScheduler->autoRotate = !myScheduler->autoRotate;
+        myScheduler->lastTime   = glfwGetTime();
         break;
     }
   }
   std::cout << rayon << std::endl;
 }
+void mouse_button_callback(GLFWwindow* window, int button, int action, int mods){
+  // Right click fills the whole smooth patch under the cursor
+  if(button == GLFW_MOUSE_BUTTON_2 && action == GLFW_PRESS && loaded(LOAD_DONE)){
+    double xpos, ypos;
+    glfwGetCursorPos(window, &xpos, &ypos);
+    int indice = -1;
+    if(intersectsWithTriangle(myContext, myObject, xpos, ypos, indice)){
+      std::vector<int> patch = myObject->segmentation.getPatch(indice);
+      for(int k = 0; k < patch.size(); k++)
+        myObject->selection.set(patch[k]/3, add);
+      myScheduler->invalidate(DIRTY_COLORS);
+    }
+  }
+}
 
 
 
@@ -248,16 +434,29 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 // MAIN PROGRAM
 int main(int argc, char** argv){
 
+  // Command line:
+  //   cube [mesh.mesh]                      - in memory display
+  //   cube mesh.mesh -convert mesh.pages    - out-of-core conversion
+  //   cube mesh.pages [budget in MB]        - out-of-core display
+  std::string mesh_path = argc > 1 ? argv[1] : "/home/him/dev/ogl/257.o.mesh";
+  if(argc > 3 && std::string(argv[2]) == "-convert"){
+    PagedMesh::convert((char*)mesh_path.c_str(), argv[3], 4096);
+    return 0;
+  }
+  bool paged = mesh_path.size() > 6 && mesh_path.substr(mesh_path.size() - 6) == ".pages";
+  size_t budget = (paged && argc > 2) ? atol(argv[2]) : 512;
+
   // Initialization of object and context pointers
   myContext = new Context();
   myObject  = new Object();
+  myScheduler = new Scheduler();
 
   // GLFW and GLEW context and window creation
   initGLFW();
   GLFWwindow* w;
   glfwWindowHint( GLFW_SAMPLES, 4);
   glfwWindowHint( GLFW_CONTEXT_VERSION_MAJOR, 3);
-  glfwWindowHint( GLFW_CONTEXT_VERSION_MINOR, 0);
+  glfwWindowHint( GLFW_CONTEXT_VERSION_MINOR, 2);
   glfwWindowHint( GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
   //glfwWindowHint( GLFW_OPENGL_PROFILE,        GLFW_OPENGL_CORE_PROFILE);
   myContext->w = 640;
@@ -271,6 +470,8 @@ int main(int argc, char** argv){
     exit(-1);
   }
   initGLEW();
+  // Vertical synchronization, set once for the whole session
+  glfwSwapInterval(1);
 
   // Callbacks used for user input (linked with the above callback functions)
   glfwSetKeyCallback(w, key_callback);
@@ -278,7 +479,8 @@ int main(int argc, char** argv){
   glfwSetCursorPosCallback(w, cursor_pos_callback);
   glfwSetWindowSizeCallback(w, window_size_callback);
   glfwSetScrollCallback(w, scroll_callback);
-  //glfwSetMouseButtonCallback(w, mouse_button_callback);
+  glfwSetWindowRefreshCallback(w, window_refresh_callback);
+  glfwSetMouseButtonCallback(w, mouse_button_callback);
 
   // Shaders and text initialization
   std::string path    = "/home/him/dev/ogl/";
@@ -287,35 +489,38 @@ int main(int argc, char** argv){
   int ID   = loadProgram(shaders+"shader.vert", shaders+"shader.frag", shaders+"shader.functions");
   GUI* gui = new GUI(    shaders+"text.vert",   shaders+"text.frag",   fonts+"arial.ttf");
 
-  // Objet creation
-  myObject->read("/home/him/dev/ogl/257.o.mesh");
-  myObject->colors.resize(myObject->vertices.size());
-  for(int i = 0 ; i < myObject->vertices.size() ; i++)
-    myObject->vertices[i]=5.0f*myObject->vertices[i];
-  for(int i = 0 ; i < myObject->colors.size() ; i++){
-    myObject->colors[i] = glm::vec3(1);
+  // Objet creation (a paged mesh leaves the object empty, and only uses its MODEL matrix)
+  // The object is read in the background, its buffers being filled by myLoader->upload()
+  if(paged){
+    myPagedMesh = new PagedMesh();
+    myPagedMesh->open(mesh_path, budget);
+  }
+  else{
+    myLoader = new Loader();
+    myLoader->start(myObject, mesh_path);
   }
   myObject->MODEL  = glm::mat4(1);
 
   // Buffer creation
   myObject->VAO = createVAO();
-  myObject->vBuffer = createBuffer(GL_ARRAY_BUFFER, &myObject->vertices);
-  myObject->cBuffer = createBuffer(GL_ARRAY_BUFFER, &myObject->colors);
-  myObject->iBuffer = createBuffer(GL_ELEMENT_ARRAY_BUFFER, &myObject->triangles);
-  myObject->nBuffer=0;
+  myObject->vBuffer = 0;
+  myObject->iBuffer = 0;
+  myObject->nBuffer = 0;
+  myObject->sBuffer = createBuffer(GL_TEXTURE_BUFFER, &myObject->selection.bits);
+  myObject->sTexture = createTextureBuffer(myObject->sBuffer, GL_R8UI);
+  myObject->selection.clean();
 
-  // Buffers linking
-  glUseProgram(ID);
-  glBindVertexArray(myObject->VAO);
-  bindBuffer(GL_ARRAY_BUFFER, myObject->vBuffer, ID, 0, "vertex_position");
-  bindBuffer(GL_ARRAY_BUFFER, myObject->nBuffer, ID, 1, "vertex_normal");
-  bindBuffer(GL_ARRAY_BUFFER, myObject->cBuffer, ID, 2, "vertex_color");
-  bindBuffer(GL_ELEMENT_ARRAY_BUFFER, myObject->iBuffer, ID);
   // Link with 0 to reinitialize
   glBindVertexArray(0);
   glUseProgram(0);
   glBindBuffer(GL_ARRAY_BUFFER, 0);
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+  // The selection mask stays bound on texture unit 1, the text only uses unit 0
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_BUFFER, myObject->sTexture);
+  glActiveTexture(GL_TEXTURE0);
 
   // View parameters
   myContext->zoom  = 1.0f;
@@ -327,62 +532,115 @@ int main(int argc, char** argv){
   myContext->zmax  = 10.0f;
   myContext->update();
 
-  myObject->createNeighbours();
+  // OpenGL initialization (this state is never modified by the text rendering)
+  glClearColor(0.1,0.1,0.1,1);
+  glEnable(GL_DEPTH_TEST);
+  glDepthFunc(GL_LESS);
+  glEnable(GL_POLYGON_OFFSET_FILL);
+  glPolygonOffset(1.0,1.0);
+  glEnable(GL_CULL_FACE);
+  glCullFace(GL_BACK);
+  glPolygonMode(GL_BACK, GL_FILL);
+
+  // Constant shader parameters, uniforms are kept by the program between frames
+  glUseProgram(ID);
+  send(ID, 1, "uLighting");
+  send(ID, 0,   "uColor");
+  send(ID, 1, "uSelection");
+  send(ID, 1, "selectionMask");
+  send(ID, glm::vec3(1,0.5,0), "selectionColor");
+  send(ID, 0,"uStructure");
+  send(ID, glm::vec3(1,1,1), "objectColor");
+  send(ID, 0, "uSecondPass");
+  send(ID, 0, "picking");
+  send(ID, 0,"clipping");
+  glUseProgram(0);
 
-  // Main display loop (executed every frame)
+  // Main display loop (a frame is only drawn when something was invalidated)
+  myScheduler->invalidate(DIRTY_ALL);
+  myScheduler->lastTime = glfwGetTime();
   while( ! (glfwGetKey(w,GLFW_KEY_ESCAPE)==GLFW_PRESS||glfwWindowShouldClose(w)==1) ){
 
-    // Listen for input
-    glfwPollEvents();
+    // Listen for input, sleeping if there is nothing to draw
+    if(myScheduler->needsDraw())
+      glfwPollEvents();
+    else
+      glfwWaitEventsTimeout(myScheduler->timeout());
+
+    // Optional auto-rotation, based on the elapsed time and not on the frame rate
+    double now = glfwGetTime();
+    if(myScheduler->autoRotate){
+      float angle = myScheduler->rotationSpeed * float(now - myScheduler->lastTime);
+      myObject->MODEL = glm::rotate(angle, myContext->up) * myObject->MODEL;
+      myScheduler->invalidate(DIRTY_MODEL);
+    }
+    myScheduler->lastTime = now;
+
+    // Data published by the loader since the last frame
+    if(myLoader && myLoader->pending())
+      myScheduler->invalidate(DIRTY_MESH);
+
+    if(!myScheduler->needsDraw())
+      continue;
 
     // Clear the background
-    glClearColor(0.1,0.1,0.1,1);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
-
-    // OpenGL initialization
     glUseProgram(ID);
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LESS);
-    glEnable(GL_POLYGON_OFFSET_FILL);
-    glPolygonOffset(1.0,1.0);
-    glEnable(GL_CULL_FACE);
-    glCullFace(GL_BACK);
-    glPolygonMode(GL_BACK, GL_FILL);
-
-    // MVP matrice and shader parameters (not that important)
-    glm::mat4 MVP = myContext->PROJ * myContext->VIEW * myObject->MODEL;
-    send(ID, MVP, 	"MVP");
-    send(ID, myObject->MODEL, "M");
-    send(ID, myContext->VIEW, "V");
-    send(ID, 1, "uLighting");
-    send(ID, 1,   "uColor");
-    send(ID, 0,"uStructure");
-    send(ID, glm::vec3(1,1,1), "objectColor");
-    send(ID, 0, "uSecondPass");
-    send(ID, 0, "picking");
-    send(ID, 0,"clipping");
-
-    myObject->MODEL = glm::rotate(0.001f, myContext->up) * myObject->MODEL;
-    glm::vec3 right = glm::cross(myContext->look, myContext->up);
-
-    // Bind the buffers to prepare drawing
-    glBindVertexArray(myObject->VAO);
-    bindBuffer(GL_ARRAY_BUFFER, myObject->cBuffer, ID, 2, "vertex_color");
-    // DRAW THE OBJECT !!!!!
-    glDrawElements(GL_TRIANGLES, myObject->triangles.size(), GL_UNSIGNED_INT, (void*)0);
-
-    //Print the radius
-    gui->text(std::to_string(rayon), 20.0f, 20.0f, 1, glm::vec3(1,0,0));
+
+    // MVP matrice, only sent when the camera or the model moved
+    if(myScheduler->dirty & (DIRTY_CAMERA | DIRTY_MODEL)){
+      glm::mat4 MVP = myContext->PROJ * myContext->VIEW * myObject->MODEL;
+      send(ID, MVP, 	"MVP");
+      send(ID, myObject->MODEL, "M");
+      send(ID, myContext->VIEW, "V");
+    }
+
+    // DRAW THE OBJECT !!!!! (the VAO already holds the attributes bindings)
+    bool pagesPending = false;
+    if(myPagedMesh){
+      pagesPending = myPagedMesh->draw(myContext, ID, myObject->MODEL);
+    }
+    else{
+      if(myScheduler->dirty & DIRTY_MESH)
+        myLoader->upload(ID);
+      // Selection, only the modified bytes are uploaded, once per frame whatever the number of paint strokes
+      if(myScheduler->dirty & DIRTY_COLORS)
+        updateMask(myObject->sBuffer, &myObject->selection);
+      glBindVertexArray(myObject->VAO);
+      glDrawElements(GL_TRIANGLES, 3 * myLoader->trianglesUploaded, GL_UNSIGNED_INT, (void*)0);
+    }
+
+    //Print the radius (paged meshes have neither brush radius nor segmentation)
+    if(!myPagedMesh)
+      gui->text(std::to_string(rayon), 20.0f, 20.0f, 1, glm::vec3(1,0,0));
     std::string status = add ? "Addition" : "Substraction" ;
     gui->text(status, 20.0f, 60.0f, 1, glm::vec3(1,0,0));
+    // The threshold is written by the loader until the segmentation is done
+    if(loaded(LOAD_DONE)){
+      int degrees = int(glm::round(glm::degrees(myObject->segmentation.threshold)));
+      gui->text("Angle " + std::to_string(degrees), 20.0f, 100.0f, 1, glm::vec3(1,0,0));
+    }
+    if(myLoader && !loaded(LOAD_DONE)){
+      std::string loading = loaded(LOAD_STRUCTURES) ? "Building structures" : "Loading " + std::to_string(int(100 * myLoader->progress())) + "%";
+      gui->text(loading, 20.0f, 420.0f, 1, glm::vec3(1,0,0));
+    }
+    if(myPagedMesh)
+      gui->text("Pages " + std::to_string(myPagedMesh->lru.size()) + "/" + std::to_string(myPagedMesh->infos.size()), 20.0f, 140.0f, 1, glm::vec3(1,0,0));
 
     // Clean up at the end of a loop
     glBindVertexArray(0);
     glfwSwapBuffers(w);
-    glfwSwapInterval(1);
+    myScheduler->dirty = 0;
+    // Keep on drawing while visible pages are loaded a few at a time
+    if(pagesPending)
+      myScheduler->invalidate(DIRTY_PAGES);
   }
 
-  // End the program
+  // End the program, stopping a loading still running before GLFW is terminated
+  if(myLoader && myLoader->thread.joinable()){
+    myLoader->cancel = true;
+    myLoader->thread.join();
+  }
   glfwDestroyWindow(w);
   glfwTerminate();
   return 0;
@@ -413,10 +671,16 @@ template<typename T>
 GLuint createBuffer(GLenum target, std::vector<T> *data){
   if(data->size()==0)
     return 0;
+  return createBuffer(target, &(*data)[0], data->size());
+}
+template<typename T>
+GLuint createBuffer(GLenum target, T* data, int n){
+  if(n==0)
+    return 0;
   GLuint b;
   glGenBuffers( 1, &b);
   glBindBuffer( target, b);
-  glBufferData( target, sizeof(T) * data->size(), &(*data)[0], GL_STATIC_DRAW);
+  glBufferData( target, sizeof(T) * n, data, GL_STATIC_DRAW);
   return b;
 }
 GLuint createVAO(){
@@ -425,6 +689,25 @@ GLuint createVAO(){
   glBindVertexArray(v);
   return v;
 }
+GLuint createTextureBuffer(GLuint buffer, GLenum format){
+  if(buffer==0)
+    return 0;
+  GLuint t;
+  glGenTextures(1, &t);
+  glBindTexture(GL_TEXTURE_BUFFER, t);
+  glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+  return t;
+}
+void updateMask(GLuint sBuffer, SelectionMask* mask){
+  // Only the bytes modified since the last upload are sent
+  if(!mask->dirty())
+    return;
+  glBindBuffer(GL_TEXTURE_BUFFER, sBuffer);
+  glBufferSubData(GL_TEXTURE_BUFFER, mask->lo, mask->hi - mask->lo, &mask->bits[mask->lo]);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  mask->clean();
+}
 void bindBuffer(GLenum target, GLuint buffer, int ID, int attrib, char* name){
   if (target == GL_ELEMENT_ARRAY_BUFFER)
     glBindBuffer( target, buffer);
@@ -437,8 +720,12 @@ void bindBuffer(GLenum target, GLuint buffer, int ID, int attrib, char* name){
 }
 template<typename T>
 void updateBuffer(GLuint pBuffer, std::vector<T> *data){
+  updateBuffer(pBuffer, &(*data)[0], data->size());
+}
+template<typename T>
+void updateBuffer(GLuint pBuffer, T* data, int n){
   glBindBuffer( GL_ARRAY_BUFFER, pBuffer);
-  glBufferData( GL_ARRAY_BUFFER, sizeof(T) * data->size(), &(*data)[0], GL_STREAM_DRAW);
+  glBufferData( GL_ARRAY_BUFFER, sizeof(T) * n, data, GL_STREAM_DRAW);
   glBindBuffer( GL_ARRAY_BUFFER, 0);
 }
 void send(int ID, glm::mat4 &m, char* name){
@@ -630,45 +917,56 @@ void GUI::text(std::string text, GLfloat x, GLfloat y, GLfloat scale, glm::vec3
   glDisable(GL_BLEND);
 }
 
-void Object::read(char * mesh_path){
+void Loader::start(Object* o, std::string mesh_path){
     //Initialisation
-    int nPts, nTri, nNor, nTet, nNorAtV;
     int ver, dim;
-    double* tmp = new double[3];
-    int refe;
+    object = o;
 
     //READING .mesh
-    int inm = GmfOpenMesh(mesh_path,GmfRead,&ver,&dim);
+    inm = GmfOpenMesh((char*)mesh_path.c_str(),GmfRead,&ver,&dim);
     if ( !inm ){
       std::cout << "Unable to open mesh file " << mesh_path << std::endl;
       exit(-1);
     }
 
-    //GETTING SIZES
-    nPts    = GmfStatKwd(inm, GmfVertices);
-    nTri    = GmfStatKwd(inm, GmfTriangles);
-    if ( !nPts || !nTri ){
+    //GETTING SIZES, so that the arrays are never reallocated while the display loop reads them
+    nVertices  = GmfStatKwd(inm, GmfVertices);
+    nTriangles = GmfStatKwd(inm, GmfTriangles);
+    if ( !nVertices || !nTriangles ){
       std::cout << "Missing data in mesh file" << mesh_path << std::endl;
       exit(-1);
     }
-    vertices.resize(nPts);
-    triangles.resize(3 * nTri);
+    object->vertices.resize(nVertices);
+    object->triangles.resize(3 * nTriangles);
+    object->selection.resize(nTriangles);
+
+    thread = std::thread(&Loader::run, this);
+  }
+void Loader::run(){
+    double tmp[3];
+    int refe;
+    std::vector<glm::vec3>& vertices  = object->vertices;
+    std::vector<int>&       triangles = object->triangles;
+    // The display loop is woken up about a hundred times during the reading
+    int batch = std::max(1, (nVertices + nTriangles) / 100);
 
-    //VERTICES & INDICES
+    //VERTICES
     GmfGotoKwd(inm,GmfVertices);
-    for (int k = 0; k < nPts; k++){
+    for (int k = 0; k < nVertices; k++){
+      if(cancel){
+        GmfCloseMesh(inm);
+        return;
+      }
       GmfGetLin(inm,GmfVertices,&tmp[0],&tmp[1],&tmp[2], &refe);
       vertices[k].x = tmp[0];
       vertices[k].y = tmp[1];
       vertices[k].z = tmp[2];
+      if((k+1) % batch == 0){
+        verticesRead = k+1;
+        glfwPostEmptyEvent();
+      }
     }
-    GmfGotoKwd(inm,GmfTriangles);
-    for (int k = 0; k < nTri; k++){
-      GmfGetLin(inm,GmfTriangles,&triangles[3*k],&triangles[3*k+1], &triangles[3*k+2], &refe);
-      triangles[3*k]-=1;
-      triangles[3*k+1]-=1;
-      triangles[3*k+2]-=1;
-    }
+    verticesRead = nVertices;
 
     glm::vec3 mi, ma;
     for(glm::vec3 v : vertices){
@@ -679,19 +977,92 @@ void Object::read(char * mesh_path){
     }
     glm::vec3 tr = -0.5f*(ma+mi);
     for(int i = 0 ; i < vertices.size() ; i++){
-      vertices[i] += tr;
+      vertices[i] = 5.0f*(vertices[i] + tr);
     }
+    stage = LOAD_TRIANGLES;
+    glfwPostEmptyEvent();
 
-    std::cout << "Succesfully opened  " << mesh_path << std::endl;
+    //INDICES, published by batches
+    GmfGotoKwd(inm,GmfTriangles);
+    for (int k = 0; k < nTriangles; k++){
+      if(cancel){
+        GmfCloseMesh(inm);
+        return;
+      }
+      GmfGetLin(inm,GmfTriangles,&triangles[3*k],&triangles[3*k+1], &triangles[3*k+2], &refe);
+      triangles[3*k]-=1;
+      triangles[3*k+1]-=1;
+      triangles[3*k+2]-=1;
+      if((k+1) % batch == 0){
+        trianglesRead = k+1;
+        glfwPostEmptyEvent();
+      }
+    }
+    trianglesRead = nTriangles;
     GmfCloseMesh(inm);
+    std::cout << "Succesfully read  " << nVertices << " vertices and " << nTriangles << " triangles" << std::endl;
+    stage = LOAD_STRUCTURES;
+    glfwPostEmptyEvent();
+
+    //Structures used by the picking, the brushes and the lighting
+    object->createNeighbours(&cancel);
+    if(cancel)
+      return;
+    object->createNormals();
+    if(cancel)
+      return;
+    object->segmentation.build(vertices, triangles);
+    if(cancel)
+      return;
+    object->segmentation.segment(object->segmentation.threshold);
+    stage = LOAD_DONE;
+    glfwPostEmptyEvent();
+  }
+bool Loader::pending(){
+  // Called by the display loop, true when something new can be uploaded or shown
+  int s = stage;
+  int v = verticesRead;
+  bool p = s != seenStage || v != seenVertices || (s >= LOAD_TRIANGLES && trianglesRead > trianglesUploaded);
+  seenStage    = s;
+  seenVertices = v;
+  return p;
+}
+void Loader::upload(int ID){
+  int s = stage;
+  glBindVertexArray(object->VAO);
+
+  // Vertices are uploaded at once, the index buffer is allocated for the whole mesh and filled as it comes
+  if(s >= LOAD_TRIANGLES && object->vBuffer == 0){
+    object->vBuffer = createBuffer(GL_ARRAY_BUFFER, &object->vertices);
+    bindBuffer(GL_ARRAY_BUFFER, object->vBuffer, ID, 0, "vertex_position");
+    glGenBuffers(1, &object->iBuffer);
+    bindBuffer(GL_ELEMENT_ARRAY_BUFFER, object->iBuffer, ID);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, 3 * sizeof(int) * nTriangles, NULL, GL_STATIC_DRAW);
   }
-void Object::createNeighbours(){
+  int ready = trianglesRead;
+  if(object->iBuffer != 0 && ready > trianglesUploaded){
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 3 * sizeof(int) * trianglesUploaded, 3 * sizeof(int) * (ready - trianglesUploaded), &object->triangles[3 * trianglesUploaded]);
+    trianglesUploaded = ready;
+  }
+  if(s == LOAD_DONE && object->nBuffer == 0){
+    object->nBuffer = createBuffer(GL_ARRAY_BUFFER, &object->normals);
+    bindBuffer(GL_ARRAY_BUFFER, object->nBuffer, ID, 1, "vertex_normal");
+  }
+
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+void Object::createNeighbours(const std::atomic<bool>* cancel){
 
     int nbh = 0; // Pour parcourir les lignes de neighbours;
 
     //Pour le triangle triangles[i] trouve les voisins et mets les dans neighbours[nbh]
     for (int i=0; i<triangles.size(); i+=3){
 
+        //Arrêt demandé par le chargement (fermeture de la fenêtre)
+        if(cancel && *cancel)
+            return;
+
         std::vector<int> tmp;
 
         //Pour chaque triangle triangles[j] verifie si c'est un voisin du triangle triangles[i]
@@ -715,6 +1086,18 @@ void Object::createNeighbours(){
         neighbours.push_back(tmp);
     }
 }
+void Object::createNormals(){
+    // Area weighted average of the faces normals
+    normals.assign(vertices.size(), glm::vec3(0));
+    for(int i = 0 ; i < triangles.size() ; i+=3){
+        glm::vec3 n = glm::cross(vertices[triangles[i+1]] - vertices[triangles[i]], vertices[triangles[i+2]] - vertices[triangles[i]]);
+        for(int k = 0 ; k < 3 ; k++)
+            normals[triangles[i+k]] += n;
+    }
+    for(int i = 0 ; i < normals.size() ; i++)
+        if(glm::length(normals[i]) > 0)
+            normals[i] = glm::normalize(normals[i]);
+}
 std::vector<int> Object::getNeighbours(int ind, int level){
     // Level = 0  - Uniquement l'indice sélectionné
     // Level = 1  - Les premiers voisins de ind
@@ -759,3 +1142,495 @@ std::vector<int> Object::getNeighbours(int ind, int level){
 
 
 
+
+
+void Segmentation::build(std::vector<glm::vec3>& vertices, std::vector<int>& triangles){
+  int nTri = triangles.size() / 3;
+
+  // Face normals
+  std::vector<glm::vec3> normals(nTri);
+  for(int t = 0 ; t < nTri ; t++){
+    glm::vec3 n = glm::cross(vertices[triangles[3*t+1]] - vertices[triangles[3*t]],
+                             vertices[triangles[3*t+2]] - vertices[triangles[3*t]]);
+    float l = glm::length(n);
+    normals[t] = l > 0 ? n / l : glm::vec3(0);
+  }
+
+  // Edges adjacency: each edge is keyed by its sorted vertices, equal keys share the edge
+  std::vector<std::pair<std::pair<int,int>, int>> halfEdges;
+  halfEdges.reserve(triangles.size());
+  for(int t = 0 ; t < nTri ; t++){
+    for(int k = 0 ; k < 3 ; k++){
+      int a = triangles[3*t+k];
+      int b = triangles[3*t+(k+1)%3];
+      halfEdges.push_back(std::make_pair(std::make_pair(std::min(a,b), std::max(a,b)), t));
+    }
+  }
+  std::sort(halfEdges.begin(), halfEdges.end());
+
+  std::vector<std::pair<float, std::pair<int,int>>> pairs;
+  for(int i = 0 ; i < halfEdges.size() ; ){
+    int j = i+1;
+    // Non-manifold edges link every triangle of the fan to the first one
+    while(j < halfEdges.size() && halfEdges[j].first == halfEdges[i].first){
+      int t1 = halfEdges[i].second, t2 = halfEdges[j].second;
+      float angle = glm::acos(glm::clamp(glm::dot(normals[t1], normals[t2]), -1.0f, 1.0f));
+      pairs.push_back(std::make_pair(angle, std::make_pair(t1, t2)));
+      j++;
+    }
+    i = j;
+  }
+
+  // Sorted once, then any threshold is just a prefix of the list
+  std::sort(pairs.begin(), pairs.end());
+  edges.resize(2 * pairs.size());
+  angles.resize(pairs.size());
+  for(int i = 0 ; i < pairs.size() ; i++){
+    angles[i]      = pairs[i].first;
+    edges[2*i]     = pairs[i].second.first;
+    edges[2*i+1]   = pairs[i].second.second;
+  }
+
+  std::vector<std::atomic<int>>(nTri).swap(parent);
+  for(int t = 0 ; t < nTri ; t++)
+    parent[t] = t;
+  united = 0;
+}
+int Segmentation::find(int t){
+  // Path halving, parents always have a smaller index than their children
+  while(true){
+    int p = parent[t].load();
+    if(p == t)
+      return t;
+    int gp = parent[p].load();
+    if(p != gp)
+      parent[t].compare_exchange_weak(p, gp);
+    t = gp;
+  }
+}
+void Segmentation::unite(int a, int b){
+  while(true){
+    a = find(a);
+    b = find(b);
+    if(a == b)
+      return;
+    // Link the larger root under the smaller one, fails if a was linked by another thread meanwhile
+    if(a < b)
+      std::swap(a, b);
+    int expected = a;
+    if(parent[a].compare_exchange_strong(expected, b))
+      return;
+  }
+}
+void Segmentation::segment(float newThreshold){
+  int nTri = parent.size();
+  int upTo = std::lower_bound(angles.begin(), angles.end(), newThreshold) - angles.begin();
+
+  // A higher threshold only adds edges to the forest, a lower one restarts from scratch
+  if(upTo < united){
+    for(int t = 0 ; t < nTri ; t++)
+      parent[t] = t;
+    united = 0;
+  }
+
+  int nThreads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::thread> threads;
+  int chunk = (upTo - united + nThreads - 1) / nThreads;
+  for(int i = 0 ; i < nThreads && chunk > 0 ; i++){
+    int begin = united + i * chunk;
+    int end   = std::min(upTo, begin + chunk);
+    threads.push_back(std::thread([this, begin, end](){
+      for(int e = begin ; e < end ; e++)
+        unite(edges[2*e], edges[2*e+1]);
+    }));
+  }
+  for(std::thread& th : threads)
+    th.join();
+  united    = upTo;
+  threshold = newThreshold;
+
+  // Patches numbering, roots are the smallest triangle of each patch
+  std::vector<int> root(nTri);
+  patch.resize(nTri);
+  int nPatches = 0;
+  for(int t = 0 ; t < nTri ; t++){
+    root[t] = find(t);
+    patch[t] = (root[t] == t) ? nPatches++ : patch[root[t]];
+  }
+
+  // Triangles grouped by patch (counting sort)
+  patchStart.assign(nPatches + 1, 0);
+  for(int t = 0 ; t < nTri ; t++)
+    patchStart[patch[t] + 1]++;
+  for(int p = 0 ; p < nPatches ; p++)
+    patchStart[p + 1] += patchStart[p];
+  patchTriangles.resize(nTri);
+  std::vector<int> fill(patchStart.begin(), patchStart.end() - 1);
+  for(int t = 0 ; t < nTri ; t++)
+    patchTriangles[fill[patch[t]]++] = t;
+
+  std::cout << nPatches << " patches below " << glm::degrees(threshold) << " degrees" << std::endl;
+}
+std::vector<int> Segmentation::getPatch(int ind){
+  // ind is an offset in the triangles array, as given by intersectsWithTriangle
+  int p = patch[ind/3];
+  std::vector<int> result;
+  result.reserve(patchStart[p+1] - patchStart[p]);
+  for(int i = patchStart[p] ; i < patchStart[p+1] ; i++)
+    result.push_back(3 * patchTriangles[i]);
+  return result;
+}
+
+// Temporary file mapped in memory, released by munmap
+void* mapTemporary(size_t size){
+  FILE* f = tmpfile();
+  if(!f || ftruncate(fileno(f), size) != 0){
+    std::cout << "Unable to create a temporary file" << std::endl;
+    exit(-1);
+  }
+  void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(f), 0);
+  fclose(f);
+  if(data == MAP_FAILED){
+    std::cout << "Unable to map a temporary file" << std::endl;
+    exit(-1);
+  }
+  return data;
+}
+// Morton code of a grid cell, so that consecutive cells are spatially close
+int morton(int x, int y, int z, int bits){
+  int code = 0;
+  for(int i = 0 ; i < bits ; i++)
+    code |= (((x >> i) & 1) << (3*i)) | (((y >> i) & 1) << (3*i+1)) | (((z >> i) & 1) << (3*i+2));
+  return code;
+}
+// Clip space test of the 8 corners of a box, false if all of them are outside the same plane
+bool boxInFrustum(glm::mat4& MVP, glm::vec3 mi, glm::vec3 ma){
+  int outside[6] = {0,0,0,0,0,0};
+  for(int i = 0 ; i < 8 ; i++){
+    glm::vec4 p = MVP * glm::vec4(i&1 ? ma.x : mi.x, i&2 ? ma.y : mi.y, i&4 ? ma.z : mi.z, 1);
+    outside[0] += p.x < -p.w;
+    outside[1] += p.x >  p.w;
+    outside[2] += p.y < -p.w;
+    outside[3] += p.y >  p.w;
+    outside[4] += p.z < -p.w;
+    outside[5] += p.z >  p.w;
+  }
+  for(int i = 0 ; i < 6 ; i++)
+    if(outside[i] == 8)
+      return false;
+  return true;
+}
+// Slab test of a ray against a box
+bool rayHitsBox(glm::vec3 origin, glm::vec3 ray, glm::vec3 mi, glm::vec3 ma){
+  float tmin = -FLT_MAX, tmax = FLT_MAX;
+  for(int i = 0 ; i < 3 ; i++){
+    if(ray[i] == 0){
+      if(origin[i] < mi[i] || origin[i] > ma[i])
+        return false;
+      continue;
+    }
+    float t1 = (mi[i] - origin[i]) / ray[i];
+    float t2 = (ma[i] - origin[i]) / ray[i];
+    tmin = std::max(tmin, std::min(t1, t2));
+    tmax = std::min(tmax, std::max(t1, t2));
+  }
+  return tmax >= std::max(tmin, 0.0f);
+}
+
+void PagedMesh::convert(char* mesh_path, std::string pages_path, int trianglesPerPage){
+  int ver, dim, refe;
+  double tmp[3];
+  int tri[3];
+
+  int inm = GmfOpenMesh(mesh_path,GmfRead,&ver,&dim);
+  if ( !inm ){
+    std::cout << "Unable to open mesh file " << mesh_path << std::endl;
+    exit(-1);
+  }
+  int nPts = GmfStatKwd(inm, GmfVertices);
+  int nTri = GmfStatKwd(inm, GmfTriangles);
+  if ( !nPts || !nTri ){
+    std::cout << "Missing data in mesh file" << mesh_path << std::endl;
+    exit(-1);
+  }
+
+  // Vertices and sorted triangles live in mapped temporary files, not in memory
+  glm::vec3* vertices = (glm::vec3*)mapTemporary(sizeof(glm::vec3) * nPts);
+  int*       sorted   = (int*)mapTemporary(3 * sizeof(int) * nTri);
+
+  GmfGotoKwd(inm,GmfVertices);
+  glm::vec3 mi(FLT_MAX), ma(-FLT_MAX);
+  for (int k = 0; k < nPts; k++){
+    GmfGetLin(inm,GmfVertices,&tmp[0],&tmp[1],&tmp[2], &refe);
+    vertices[k] = glm::vec3(tmp[0], tmp[1], tmp[2]);
+    mi = glm::min(mi, vertices[k]);
+    ma = glm::max(ma, vertices[k]);
+  }
+  // Same centering and scaling as the in memory display
+  glm::vec3 tr = -0.5f*(ma+mi);
+  for (int k = 0; k < nPts; k++)
+    vertices[k] = 5.0f * (vertices[k] + tr);
+  mi = 5.0f * (mi + tr);
+  ma = 5.0f * (ma + tr);
+
+  // Triangles are binned in a grid by their centroid, cells being ordered along a Morton curve
+  int bits = 0;
+  while(bits < 7 && (1 << (3*bits)) < 8 * (nTri / trianglesPerPage + 1))
+    bits++;
+  int res = 1 << bits;
+  glm::vec3 cellSize = glm::max(ma - mi, glm::vec3(1e-12f)) / float(res);
+  std::vector<long long> cells((1 << (3*bits)) + 1, 0);
+  for(int pass = 0 ; pass < 2 ; pass++){
+    GmfGotoKwd(inm,GmfTriangles);
+    for (int k = 0; k < nTri; k++){
+      GmfGetLin(inm,GmfTriangles,&tri[0],&tri[1],&tri[2], &refe);
+      glm::vec3 c = (vertices[tri[0]-1] + vertices[tri[1]-1] + vertices[tri[2]-1]) / 3.0f;
+      glm::ivec3 cell = glm::clamp(glm::ivec3((c - mi) / cellSize), glm::ivec3(0), glm::ivec3(res-1));
+      int code = morton(cell.x, cell.y, cell.z, bits);
+      // First pass counts the triangles of each cell, second pass stores them at their cell offset
+      if(pass == 0)
+        cells[code + 1]++;
+      else{
+        long long pos = cells[code]++;
+        for(int i = 0 ; i < 3 ; i++)
+          sorted[3*pos+i] = tri[i] - 1;
+      }
+    }
+    if(pass == 0)
+      for(int i = 1 ; i < cells.size() ; i++)
+        cells[i] += cells[i-1];
+  }
+  GmfCloseMesh(inm);
+
+  // Pages: consecutive runs of sorted triangles, with their vertices renumbered locally
+  int out = ::open(pages_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(out < 0){
+    std::cout << "Unable to create " << pages_path << std::endl;
+    exit(-1);
+  }
+  PageFileHeader header;
+  memcpy(header.magic, "OGLPAGE2", 8);
+  header.nPages           = (nTri + trianglesPerPage - 1) / trianglesPerPage;
+  header.trianglesPerPage = trianglesPerPage;
+  header.alignment        = 1 << 16;
+  std::vector<PageInfo> infos(header.nPages);
+  long long offset = sizeof(header) + sizeof(PageInfo) * header.nPages;
+
+  for(int p = 0 ; p < header.nPages ; p++){
+    std::unordered_map<int,int> local;
+    std::vector<glm::vec3>      pVertices;
+    std::vector<int>            pTriangles;
+    PageInfo& info = infos[p];
+    info.mi = glm::vec3(FLT_MAX);
+    info.ma = glm::vec3(-FLT_MAX);
+    for(int t = p * trianglesPerPage ; t < std::min(nTri, (p+1) * trianglesPerPage) ; t++){
+      for(int i = 0 ; i < 3 ; i++){
+        int v = sorted[3*t+i];
+        std::unordered_map<int,int>::iterator it = local.find(v);
+        if(it == local.end()){
+          it = local.insert(std::make_pair(v, (int)pVertices.size())).first;
+          pVertices.push_back(vertices[v]);
+          info.mi = glm::min(info.mi, vertices[v]);
+          info.ma = glm::max(info.ma, vertices[v]);
+        }
+        pTriangles.push_back(it->second);
+      }
+    }
+    info.offset     = (offset + header.alignment - 1) / header.alignment * header.alignment;
+    info.nVertices  = pVertices.size();
+    info.nTriangles = pTriangles.size() / 3;
+    info.size       = sizeof(glm::vec3) * info.nVertices + sizeof(int) * pTriangles.size();
+    long long pos = info.offset;
+    pos += pwrite(out, &pVertices[0],  sizeof(glm::vec3) * pVertices.size(), pos);
+    pos += pwrite(out, &pTriangles[0], sizeof(int) * pTriangles.size(),      pos);
+    if(pos != info.offset + info.size){
+      std::cout << "Unable to write " << pages_path << std::endl;
+      exit(-1);
+    }
+    offset = pos;
+  }
+  pwrite(out, &header,   sizeof(header),                   0);
+  pwrite(out, &infos[0], sizeof(PageInfo) * infos.size(),  sizeof(header));
+  ::close(out);
+
+  munmap(vertices, sizeof(glm::vec3) * nPts);
+  munmap(sorted,   3 * sizeof(int) * nTri);
+  std::cout << "Succesfully converted " << mesh_path << " in " << header.nPages << " pages" << std::endl;
+}
+void PagedMesh::open(std::string path, size_t budgetMB){
+  fd = ::open(path.c_str(), O_RDONLY);
+  if(fd < 0){
+    std::cout << "Unable to open pages file " << path << std::endl;
+    exit(-1);
+  }
+  PageFileHeader header;
+  if(pread(fd, &header, sizeof(header), 0) != sizeof(header) || strncmp(header.magic, "OGLPAGE2", 8) != 0){
+    std::cout << "Invalid pages file " << path << std::endl;
+    exit(-1);
+  }
+  infos.resize(header.nPages);
+  if(pread(fd, &infos[0], sizeof(PageInfo) * infos.size(), sizeof(header)) != sizeof(PageInfo) * infos.size()){
+    std::cout << "Truncated pages file " << path << std::endl;
+    exit(-1);
+  }
+  pages.assign(infos.size(), NULL);
+  prefetched.assign(infos.size(), false);
+  masks.resize(infos.size());
+  budget = budgetMB << 20;
+  std::cout << "Succesfully opened  " << path << " (" << infos.size() << " pages)" << std::endl;
+}
+Page* PagedMesh::load(int p, int ID){
+  PageInfo& info = infos[p];
+
+  // Make room for the page, least recently drawn pages first
+  while(used + info.size > budget){
+    if(lru.empty() || pages[lru.back()]->lastFrame == frame)
+      return NULL;
+    evict(lru.back());
+  }
+
+  // The file is never modified, the selection only lives in masks for the session
+  void* data = mmap(NULL, info.size, PROT_READ, MAP_PRIVATE, fd, info.offset);
+  if(data == MAP_FAILED){
+    std::cout << "Unable to map page " << p << std::endl;
+    return NULL;
+  }
+  Page* page        = new Page();
+  page->data        = data;
+  page->vertices    = (glm::vec3*)data;
+  page->triangles   = (int*)(page->vertices + info.nVertices);
+  page->lastFrame   = frame;
+
+  page->VAO     = createVAO();
+  page->vBuffer = createBuffer(GL_ARRAY_BUFFER, page->vertices, info.nVertices);
+  page->iBuffer = createBuffer(GL_ELEMENT_ARRAY_BUFFER, page->triangles, 3 * info.nTriangles);
+  bindBuffer(GL_ARRAY_BUFFER, page->vBuffer, ID, 0, "vertex_position");
+  bindBuffer(GL_ELEMENT_ARRAY_BUFFER, page->iBuffer, ID);
+  glBindVertexArray(0);
+
+  // The mask is only allocated the first time the page is loaded
+  SelectionMask& mask = masks[p];
+  if(mask.size() == 0)
+    mask.resize(info.nTriangles);
+  page->sBuffer  = createBuffer(GL_TEXTURE_BUFFER, &mask.bits);
+  page->sTexture = createTextureBuffer(page->sBuffer, GL_R8UI);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  mask.clean();
+
+  lru.push_front(p);
+  page->lru = lru.begin();
+  pages[p]  = page;
+  used     += info.size;
+  return page;
+}
+void PagedMesh::evict(int p){
+  Page* page = pages[p];
+  GLuint buffers[3] = {page->vBuffer, page->iBuffer, page->sBuffer};
+  glDeleteBuffers(3, buffers);
+  glDeleteTextures(1, &page->sTexture);
+  glDeleteVertexArrays(1, &page->VAO);
+  munmap(page->data, infos[p].size);
+  lru.erase(page->lru);
+  used         -= infos[p].size;
+  pages[p]      = NULL;
+  prefetched[p] = false;
+  delete page;
+}
+bool PagedMesh::draw(Context* c, int ID, glm::mat4& MODEL){
+  frame++;
+  glm::mat4 MVP = c->PROJ * c->VIEW * MODEL;
+  glm::vec3 eye = glm::vec3(glm::inverse(MODEL) * glm::vec4(c->cam, 1));
+
+  // Visible pages, nearest first so that missing pages fill in from the front
+  std::vector<std::pair<float,int>> visible;
+  for(int p = 0 ; p < infos.size() ; p++)
+    if(boxInFrustum(MVP, infos[p].mi, infos[p].ma))
+      visible.push_back(std::make_pair(glm::distance(eye, 0.5f*(infos[p].mi + infos[p].ma)), p));
+  std::sort(visible.begin(), visible.end());
+
+  bool pending = false;
+  int  loads   = 0;
+  glActiveTexture(GL_TEXTURE1);
+  for(int i = 0 ; i < visible.size() ; i++){
+    int   p    = visible[i].second;
+    Page* page = pages[p];
+    if(!page){
+      // Only a few pages are loaded per frame, the next frames load the others
+      if(loads == maxLoadsPerFrame){
+        pending = true;
+        continue;
+      }
+      page = load(p, ID);
+      if(!page)
+        continue;
+      loads++;
+    }
+    page->lastFrame = frame;
+    lru.splice(lru.begin(), lru, page->lru);
+    // gl_PrimitiveID restarts at 0 for each page, so each page has its own mask on unit 1
+    updateMask(page->sBuffer, &masks[p]);
+    glBindTexture(GL_TEXTURE_BUFFER, page->sTexture);
+    glBindVertexArray(page->VAO);
+    glDrawElements(GL_TRIANGLES, 3 * infos[p].nTriangles, GL_UNSIGNED_INT, (void*)0);
+  }
+  glBindVertexArray(0);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+  glActiveTexture(GL_TEXTURE0);
+
+  prefetch(c, MODEL);
+  return pending;
+}
+void PagedMesh::prefetch(Context* c, glm::mat4& MODEL){
+  // Pages just outside the view, ordered along the view direction, are read ahead by the kernel
+  glm::mat4 wide    = glm::perspective(glm::radians(std::min(1.5f * c->fov, 170.0f)), (float)c->w / (float)c->h, c->zmin, c->zmax);
+  glm::mat4 MVP     = wide * c->VIEW * MODEL;
+  glm::mat4 inv     = glm::inverse(MODEL);
+  glm::vec3 eye     = glm::vec3(inv * glm::vec4(c->cam, 1));
+  glm::vec3 viewDir = glm::normalize(glm::vec3(inv * glm::vec4(c->look - c->cam, 0)));
+
+  std::vector<std::pair<float,int>> candidates;
+  for(int p = 0 ; p < infos.size() ; p++){
+    if(pages[p])
+      continue;
+    // Pages leaving the wide view may be dropped by the kernel, they will be read ahead again
+    if(!boxInFrustum(MVP, infos[p].mi, infos[p].ma))
+      prefetched[p] = false;
+    else if(!prefetched[p])
+      candidates.push_back(std::make_pair(glm::dot(0.5f*(infos[p].mi + infos[p].ma) - eye, viewDir), p));
+  }
+  std::sort(candidates.begin(), candidates.end());
+
+  for(int i = 0 ; i < candidates.size() && i < maxPrefetch ; i++){
+    int p = candidates[i].second;
+    posix_fadvise(fd, infos[p].offset, infos[p].size, POSIX_FADV_WILLNEED);
+    prefetched[p] = true;
+  }
+}
+bool PagedMesh::intersects(Context* c, int x, int y, glm::mat4& MODEL, int& page, int& ind){
+  // The ray is brought in the model space, where the pages boxes are defined
+  glm::mat4 inv    = glm::inverse(MODEL);
+  glm::vec3 origin = glm::vec3(inv * glm::vec4(c->cam, 1));
+  glm::vec3 ray    = glm::normalize(glm::vec3(inv * glm::vec4(computeRay(c, x, y), 0)));
+
+  float best = FLT_MAX;
+  for(std::list<int>::iterator it = lru.begin() ; it != lru.end() ; it++){
+    int p = *it;
+    if(!rayHitsBox(origin, ray, infos[p].mi, infos[p].ma))
+      continue;
+    Page* pg = pages[p];
+    for(int i = 0 ; i < 3 * infos[p].nTriangles ; i+=3){
+      glm::vec3 tmpIntersection;
+      if( glm::intersectRayTriangle(origin, ray, pg->vertices[pg->triangles[i]], pg->vertices[pg->triangles[i+1]], pg->vertices[pg->triangles[i+2]], tmpIntersection)
+          && tmpIntersection.z < best ){
+        best = tmpIntersection.z;
+        page = p;
+        ind  = i;
+      }
+    }
+  }
+  return best < FLT_MAX;
+}
+void PagedMesh::paint(int page, int ind, bool value){
+  // ind is an offset in the page triangles, uploaded with the next draw
+  masks[page].set(ind/3, value);
+}
\ No newline at end of file
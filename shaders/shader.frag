@@ -1,4 +1,4 @@
-#version 140
+#version 150
 //#version 330 core
 
 in vec3 frag_position;
@@ -26,6 +26,13 @@ uniform int uLighting;
 // 3 - checker
 uniform int uColor;
 
+//Selection, one bit per triangle (bit id&7 of byte id>>3)
+// 0 - no selection
+// 1 - selected triangles drawn with selectionColor
+uniform int uSelection;
+uniform usamplerBuffer selectionMask;
+uniform vec3 selectionColor;
+
 //picking rendering
 uniform int picking;
 
@@ -77,6 +84,12 @@ void main(){
   if(uStructure == 1 && uSecondPass==0)
     temp_color = objectColor;
 
+  if(uSelection == 1){
+    uint byte = texelFetch(selectionMask, gl_PrimitiveID >> 3).r;
+    if( ((byte >> uint(gl_PrimitiveID & 7)) & 1u) == 1u )
+      temp_color = selectionColor;
+  }
+
   //if(uLighting == 0)
   if(uLighting == 1)
     temp_color = light(LM, temp_color, 0) + light(back, temp_color, 0);
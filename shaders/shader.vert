@@ -1,4 +1,4 @@
-#version 140
+#version 150
 //#version 330 core
 
 in vec3 vertex_position;
@@ -0,0 +1,87 @@
+// Tests of the per-triangle selection mask, no OpenGL needed
+#include <stdio.h>
+#include "selection.h"
+
+int failures = 0;
+#define CHECK(cond) \
+  if(!(cond)){ \
+    fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+    failures++; \
+  }
+
+void testResize(){
+  SelectionMask m;
+  m.resize(20);
+  CHECK(m.size() == 3);
+  // The whole mask must be uploaded after a resize
+  CHECK(m.dirty() && m.lo == 0 && m.hi == 3);
+  for(int t = 0 ; t < 20 ; t++)
+    CHECK(!m.get(t));
+}
+void testSetGet(){
+  SelectionMask m;
+  m.resize(24);
+  m.clean();
+  // Around the bytes boundaries
+  int ts[4] = {7, 8, 15, 16};
+  for(int i = 0 ; i < 4 ; i++)
+    m.set(ts[i], true);
+  for(int t = 0 ; t < 24 ; t++)
+    CHECK(m.get(t) == (t == 7 || t == 8 || t == 15 || t == 16));
+  CHECK(m.bits[0] == 0x80 && m.bits[1] == 0x81 && m.bits[2] == 0x01);
+  CHECK(m.count() == 4);
+  m.set(8, false);
+  CHECK(!m.get(8) && m.get(7) && m.get(15));
+  CHECK(m.count() == 3);
+}
+void testUnchanged(){
+  SelectionMask m;
+  m.resize(16);
+  m.clean();
+  m.set(3, false);
+  CHECK(!m.dirty());
+  m.set(3, true);
+  m.clean();
+  m.set(3, true);
+  CHECK(!m.dirty());
+}
+void testRange(){
+  SelectionMask m;
+  m.resize(64);
+  m.clean();
+  m.set(20, true);
+  CHECK(m.lo == 2 && m.hi == 3);
+  m.set(50, true);
+  CHECK(m.lo == 2 && m.hi == 7);
+  m.set(1, true);
+  CHECK(m.lo == 0 && m.hi == 7);
+  m.clean();
+  CHECK(!m.dirty() && m.lo == 0 && m.hi == 0);
+}
+void testClear(){
+  SelectionMask m;
+  m.resize(64);
+  m.set(27, true);
+  m.set(35, true);
+  m.clean();
+  // Only the non-zero bytes are touched
+  m.clear();
+  CHECK(m.dirty() && m.lo == 3 && m.hi == 5);
+  CHECK(m.count() == 0);
+  m.clean();
+  m.clear();
+  CHECK(!m.dirty());
+}
+
+int main(){
+  testResize();
+  testSetGet();
+  testUnchanged();
+  testRange();
+  testClear();
+  if(failures)
+    fprintf(stderr, "%d failure(s)\n", failures);
+  else
+    printf("All selection tests passed\n");
+  return failures ? 1 : 0;
+}